@@ -42,12 +42,23 @@ enum ClientFrameType {
     RESP_RECV_TCP,
     // 0x0b
     RESP_BIND_UDP,
-    // 0x0d
+    // 0x0c
     RECV_DATA,
-    // 14 (0x0e)
+    // 13 (0x0d)
     RESP_CLOSE,
-    // 15
-    RESP_QUERY_DNS
+    // 14 (0x0e)
+    RESP_QUERY_DNS,
+    // 15 (0x0f)
+    // Resolve a host name and open a TCP connection in one request.
+    // Answered with an extended RESP_OPEN_TCP that carries the address 
+    // that was actually connected.
+    REQ_OPEN_TCP_NAME = 15,
+    // 16 (0x10)
+    // Switch the client connection into unframed passthrough for a 
+    // TCP channel (see RequestRawTCP)
+    REQ_RAW_TCP = 16,
+    // 17 (0x11)
+    RESP_RAW_TCP = 17
 };
 
 uint16_t a_htons(uint16_t a) {
@@ -117,6 +128,13 @@ private:
 } __attribute__((packed));
 
 
+// NOTE: When the server is built with TCP_FAST_OPEN a successful 
+// RESP_OPEN_TCP only means that the connection was started.  If a Fast 
+// Open cookie is already known for the destination, the handshake is 
+// deferred until the first REQ_SEND_TCP and an unreachable destination 
+// is reported as a RESP_CLOSE.  Protocols where the server speaks first 
+// will not see any data until the client sends something.  
+// REQ_OPEN_TCP_NAME never uses Fast Open.
 struct RequestOpenTCP {
     be_uint16_t len;
     be_uint16_t type;
@@ -125,6 +143,20 @@ struct RequestOpenTCP {
     be_uint16_t port;
 };
 
+// Len = 8 + name (no null terminator required).  Names longer than 64 
+// bytes are rejected.  The name may be resolved from the server's DNS 
+// cache (see RequestQueryDNS) and each address is given a few seconds to
+// connect before the next one is tried.
+struct RequestOpenTCPName {
+    be_uint16_t len;
+    be_uint16_t type;
+    be_uint16_t clientId;
+    be_uint16_t port;
+    // WARNING: Content will be of a different length!  This is just defining
+    // the maximum area that can be used by the packet.
+    char name[64];
+};
+
 struct RequestSendTCP {
     be_uint16_t len;
     be_uint16_t type;
@@ -134,12 +166,47 @@ struct RequestSendTCP {
     uint8_t contentPlaceholder[2048];
 };
 
+// Asks the server to stop framing for a TCP channel.  Once a successful
+// RESP_RAW_TCP has been sent the client connection carries only the raw 
+// bytes of the channel: exactly downLen bytes from the server to the 
+// client and exactly upLen bytes from the client to the server.  After 
+// both counts are exhausted the channel is closed, a RESP_CLOSE is sent, 
+// and framed mode resumes.
+//
+// NOTE: downLen counts every byte received from the destination after the
+// RESP_RAW_TCP, including anything that was already buffered for the 
+// channel but not yet sent to the client as RESP_RECV_TCP.
+struct RequestRawTCP {
+    be_uint16_t len;
+    be_uint16_t type;
+    be_uint16_t clientId;
+    be_uint32_t downLen;
+    be_uint32_t upLen;
+};
+
+struct ResponseRawTCP {
+    be_uint16_t len;
+    be_uint16_t type;
+    be_uint16_t clientId;
+    be_uint16_t rc;
+};
+
+// REQ_QUERY_DNS always does a fresh lookup on the server.  The result 
+// also refreshes the server's DNS cache, which REQ_OPEN_TCP_NAME uses 
+// for up to 300 seconds.
 struct RequestQueryDNS {
     be_uint16_t len;
     be_uint16_t type;
     char name[64];
 };
 
+// NOTE: When the server is built with a shared UDP pool 
+// (SHARED_UDP_POOL_SIZE > 0) a bindPort of 0 is carried on shared sockets.
+// This is an opt-in trade-off: RECV_DATA is only delivered for peers 
+// that the channel has already sent to (REQ_SEND_UDP), datagrams from 
+// any other peer are dropped.  The source port seen by a peer is not 
+// necessarily the same for every peer.  Bind to an explicit port to get
+// a dedicated socket.
 struct RequestBindUDP {
     be_uint16_t len;
     be_uint16_t type;
@@ -7,15 +7,47 @@
 #include <sys/types.h> 
 #include <unistd.h> 
 #include <fcntl.h>
+#include <errno.h>
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
 
 #define PORT 8100
+// Number of shared UDP sockets used to carry ephemeral-port UDP channels.
+// Set to 0 to give each REQ_BIND_UDP its own socket.
+#define SHARED_UDP_POOL_SIZE 0
+// Limit on datagrams drained from one shared socket per select() wakeup
+#define SHARED_UDP_DRAIN_LIMIT 32
+// Longest wait for each address tried by REQ_OPEN_TCP_NAME (seconds)
+#define TCP_NAME_CONNECT_TIMEOUT 3
+// Largest chunk moved through the pipe in one splice() call
+#define RAW_SPLICE_CHUNK 65536
+// Use TCP Fast Open on REQ_OPEN_TCP connections so that the first 
+// REQ_SEND_TCP payload can ride in the SYN.  NOTE: This changes the 
+// meaning of RESP_OPEN_TCP (see RequestOpenTCP).
+#define TCP_FAST_OPEN 0
+// Most pre-established idle connections kept per destination.  Set to 0
+// to disable the pool.
+#define TCP_POOL_MAX_IDLE 0
+// Destinations stop being pre-warmed after this many idle connections in 
+// a row are lost to a close/data from the far end
+#define TCP_POOL_MAX_READABLE_DROPS 3
+// Idle connections older than this are discarded (seconds)
+#define TCP_POOL_MAX_AGE 20
+// Window over which destination open rates are averaged (seconds)
+#define TCP_POOL_RATE_WINDOW 60
+// Idle connections are sized to cover the opens expected in this 
+// period (seconds)
+#define TCP_POOL_HORIZON 10
 
 #include <iostream>
 #include <vector>
 #include <algorithm>
 #include <cassert>
+#include <map>
+#include <unordered_map>
+#include <string>
+#include <ctime>
+#include <cmath>
 
 #include "microtunnel/common.h"
 #include "kc1fsz-tools/Common.h"
@@ -32,6 +64,371 @@ void panic(const char* msg) {
 }
 }
 
+/**
+ * A pool of UDP sockets that is shared by all of the ephemeral-port UDP 
+ * channels (REQ_BIND_UDP with bindPort 0) across all clients. 
+ *
+ * A channel is given a "home" socket when it is bound.  The first time
+ * the channel sends to a peer, the (socket, peer address, peer port) 
+ * tuple is registered to that channel in a hash index so that inbound 
+ * datagrams from the peer can be routed back to it.  If the home socket 
+ * is already carrying traffic between another channel and the same peer 
+ * then the next socket in the pool is tried.
+ *
+ * NOTE: Datagrams from peers that the channel has not sent to are 
+ * dropped, much like a NAT.
+ */
+class SharedUDPPool {
+public:
+
+    struct Owner {
+        int clientFd;
+        uint16_t channelId;
+    };
+
+    bool isEnabled() const { return !_fds.empty(); }
+
+    bool open(unsigned int size, Log* log) {
+        for (unsigned int i = 0; i < size; i++) {
+            int fd = socket(AF_INET, SOCK_DGRAM, 0);
+            if (fd < 0) {
+                log->error("Shared UDP socket creation failed");
+                close();
+                return false;
+            }
+            struct sockaddr_in bindAddr; 
+            memset(&bindAddr, 0, sizeof(bindAddr)); 
+            bindAddr.sin_family = AF_INET; 
+            bindAddr.sin_addr.s_addr = INADDR_ANY; 
+            bindAddr.sin_port = 0; 
+            if (bind(fd, (const struct sockaddr *)&bindAddr, sizeof(bindAddr)) < 0) {
+                log->error("Shared UDP socket bind failed");
+                ::close(fd);
+                close();
+                return false;
+            }
+            int flags = fcntl(fd, F_GETFL, 0);
+            fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+            _fds.push_back(fd);
+        }
+        log->info("Shared UDP pool of %u sockets", size);
+        return true;
+    }
+
+    void close() {
+        for (int fd : _fds) 
+            ::close(fd);
+        _fds.clear();
+    }
+
+    const std::vector<int>& fds() const { return _fds; }
+
+    unsigned int assignHome() { 
+        return _nextHome++ % _fds.size(); 
+    }
+
+    /**
+     * @returns The socket that the channel should use to send to the 
+     *   peer, or -1 if no socket is available.
+     */
+    int selectSocket(int clientFd, uint16_t channelId, unsigned int home, 
+        uint32_t addr, uint16_t port) {
+        for (unsigned int i = 0; i < _fds.size(); i++) {
+            const unsigned int index = (home + i) % _fds.size();
+            auto it = _index.find(_makeKey(index, addr, port));
+            if (it == _index.end()) {
+                _index[_makeKey(index, addr, port)] = { clientFd, channelId };
+                return _fds[index];
+            } 
+            else if (it->second.clientFd == clientFd && 
+                     it->second.channelId == channelId) {
+                return _fds[index];
+            }
+        }
+        return -1;
+    }
+
+    bool lookup(unsigned int index, uint32_t addr, uint16_t port, Owner& owner) const {
+        auto it = _index.find(_makeKey(index, addr, port));
+        if (it == _index.end()) {
+            return false;
+        }
+        owner = it->second;
+        return true;
+    }
+
+    // Removes all routes for a channel
+    void release(int clientFd, uint16_t channelId) {
+        for (auto it = _index.begin(); it != _index.end(); ) {
+            if (it->second.clientFd == clientFd && it->second.channelId == channelId)
+                it = _index.erase(it);
+            else 
+                it++;
+        }
+    }
+
+    // Removes all routes for all of a client's channels
+    void releaseClient(int clientFd) {
+        for (auto it = _index.begin(); it != _index.end(); ) {
+            if (it->second.clientFd == clientFd)
+                it = _index.erase(it);
+            else 
+                it++;
+        }
+    }
+
+private:
+
+    static uint64_t _makeKey(unsigned int index, uint32_t addr, uint16_t port) {
+        return ((uint64_t)(index & 0xffff) << 48) | ((uint64_t)addr << 16) | port;
+    }
+
+    std::vector<int> _fds;
+    unsigned int _nextHome = 0;
+    std::unordered_map<uint64_t, Owner> _index;
+};
+
+static SharedUDPPool udpPool;
+
+/**
+ * Keeps a small number of idle, already established TCP connections to 
+ * destinations that are being opened frequently so that REQ_OPEN_TCP can 
+ * be answered without waiting for a handshake.
+ *
+ * The open rate of each destination is tracked as an exponentially 
+ * decaying count over TCP_POOL_RATE_WINDOW and the number of idle 
+ * connections is sized to cover the opens expected over TCP_POOL_HORIZON.
+ * Idle connections are made with non-blocking connects that are 
+ * completed from the main select() loop.  A destination whose idle 
+ * connections keep getting closed or receiving data (e.g. a server that 
+ * sends a banner) stops being pre-warmed.
+ */
+class TCPConnectPool {
+public:
+
+    TCPConnectPool(unsigned int maxIdle) : _maxIdle(maxIdle) { }
+
+    bool isEnabled() const { return _maxIdle > 0; }
+
+    /**
+     * Hands out an idle connection to the destination if one is ready.  
+     * The returned socket is in blocking mode.
+     *
+     * @returns The connected socket, or -1 if none is available.
+     */
+    int take(uint32_t addr, uint16_t port, Log* log) {
+
+        auto d = _dests.find(_makeKey(addr, port));
+        if (d == _dests.end()) 
+            return -1;
+        Dest& dest = d->second;
+
+        for (auto it = dest.conns.begin(); it != dest.conns.end(); ) {
+            if (!it->connected) {
+                it++;
+                continue;
+            }
+            const int fd = it->fd;
+            it = dest.conns.erase(it);
+            // Make sure nothing (close/reset/data) has arrived from the 
+            // far end since the last poll()
+            uint8_t b;
+            if (recv(fd, &b, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && 
+                (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                int flags = fcntl(fd, F_GETFL, 0);
+                fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+                dest.readableDrops = 0;
+                return fd;
+            }
+            ::close(fd);
+            _noteReadableDrop(dest, addr, port, log);
+        }
+        return -1;
+    }
+
+    /**
+     * Records a successful open to the destination, which drives the 
+     * number of idle connections kept for it.  Should be called once 
+     * per open request.
+     *
+     * @param hit Indicates that the connection came from take().
+     */
+    void recordOpen(uint32_t addr, uint16_t port, bool hit, Log* log) {
+
+        if (!isEnabled())
+            return;
+
+        const time_t now = time(0);
+        Dest& dest = _dests[_makeKey(addr, port)];
+        dest.count = _decayedCount(dest, now) + 1;
+        dest.lastUpdate = now;
+
+        if (hit) 
+            _hits++;
+        else 
+            _misses++;
+        log->info("TCP pool %s (hits %u misses %u)", hit ? "hit" : "miss", _hits, _misses);
+    }
+
+    /**
+     * Discards stale connections and starts new ones to bring each 
+     * destination up to its target.  Should be called about once a second.
+     */
+    void maintain(Log* log) {
+
+        const time_t now = time(0);
+
+        for (auto it = _dests.begin(); it != _dests.end(); ) {
+
+            Dest& dest = it->second;
+            const uint32_t addr = it->first >> 16;
+            const uint16_t port = it->first & 0xffff;
+
+            for (auto c = dest.conns.begin(); c != dest.conns.end(); ) {
+                if (now - c->created > TCP_POOL_MAX_AGE) {
+                    ::close(c->fd);
+                    c = dest.conns.erase(c);
+                } else {
+                    c++;
+                }
+            }
+
+            // A single recent open doesn't make a destination hot
+            const double count = _decayedCount(dest, now);
+            unsigned int target = 0;
+            if (count >= 2 && !dest.speaksFirst) {
+                target = std::min(_maxIdle, 
+                    (unsigned int)ceil(count * TCP_POOL_HORIZON / TCP_POOL_RATE_WINDOW));
+            }
+
+            while (dest.conns.size() < target) {
+                Conn conn;
+                conn.fd = _startConnect(addr, port);
+                if (conn.fd < 0) {
+                    log->error("TCP pool connect failed");
+                    break;
+                }
+                conn.created = now;
+                dest.conns.push_back(conn);
+            }
+
+            if (dest.conns.empty() && count < 0.5)
+                it = _dests.erase(it);
+            else 
+                it++;
+        }
+    }
+
+    void addFds(fd_set* rfds, fd_set* wfds, int& maxFd) const {
+        for (const auto& d : _dests) {
+            for (const Conn& conn : d.second.conns) {
+                maxFd = std::max(maxFd, conn.fd);
+                // Connected sockets are watched for a close/data from the 
+                // far end, which makes them unusable
+                if (conn.connected) 
+                    FD_SET(conn.fd, rfds);
+                else 
+                    FD_SET(conn.fd, wfds);
+            }
+        }
+    }
+
+    void poll(fd_set* rfds, fd_set* wfds, Log* log) {
+        for (auto& d : _dests) {
+            std::vector<Conn>& conns = d.second.conns;
+            for (auto c = conns.begin(); c != conns.end(); ) {
+                bool drop = false;
+                if (c->connected) {
+                    if (FD_ISSET(c->fd, rfds)) {
+                        drop = true;
+                        _noteReadableDrop(d.second, d.first >> 16, d.first & 0xffff, log);
+                    }
+                } 
+                else if (FD_ISSET(c->fd, wfds)) {
+                    int err = 0;
+                    socklen_t errLen = sizeof(err);
+                    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &errLen) != 0 || err != 0) 
+                        drop = true;
+                    else
+                        c->connected = true;
+                }
+                if (drop) {
+                    ::close(c->fd);
+                    c = conns.erase(c);
+                } else {
+                    c++;
+                }
+            }
+        }
+    }
+
+private:
+
+    struct Conn {
+        int fd = 0;
+        bool connected = false;
+        time_t created = 0;
+    };
+
+    struct Dest {
+        std::vector<Conn> conns;
+        // Decaying count of recent opens as of lastUpdate
+        double count = 0;
+        time_t lastUpdate = 0;
+        // Idle connections lost to a close/data from the far end since 
+        // the last hit
+        unsigned int readableDrops = 0;
+        // Set once the destination looks like it sends first (banner, 
+        // etc.) or closes idle connections, it is no longer pre-warmed
+        bool speaksFirst = false;
+    };
+
+    static void _noteReadableDrop(Dest& dest, uint32_t addr, uint16_t port, Log* log) {
+        if (!dest.speaksFirst && ++dest.readableDrops >= TCP_POOL_MAX_READABLE_DROPS) {
+            dest.speaksFirst = true;
+            struct in_addr a;
+            a.s_addr = htonl(addr);
+            char buf[32];
+            inet_ntop(AF_INET, &a, buf, 32);
+            log->info("TCP pool disabled for %s:%d, idle connections don't stay quiet", 
+                buf, port);
+        }
+    }
+
+    static uint64_t _makeKey(uint32_t addr, uint16_t port) {
+        return ((uint64_t)addr << 16) | port;
+    }
+
+    static double _decayedCount(const Dest& dest, time_t now) {
+        return dest.count * exp(-(double)(now - dest.lastUpdate) / TCP_POOL_RATE_WINDOW);
+    }
+
+    static int _startConnect(uint32_t addr, uint16_t port) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) 
+            return -1;
+        int flags = fcntl(fd, F_GETFL, 0);
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        struct sockaddr_in target; 
+        memset(&target, 0, sizeof(target)); 
+        target.sin_family = AF_INET; 
+        target.sin_addr.s_addr = htonl(addr); 
+        target.sin_port = htons(port); 
+        if (connect(fd, (sockaddr*)&target, sizeof(target)) != 0 && errno != EINPROGRESS) {
+            ::close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    const unsigned int _maxIdle;
+    std::unordered_map<uint64_t, Dest> _dests;
+    uint32_t _hits = 0;
+    uint32_t _misses = 0;
+};
+
+static TCPConnectPool tcpPool(TCP_POOL_MAX_IDLE);
+
 struct Proxy {
 
     void close() {
@@ -46,7 +443,12 @@ struct Proxy {
     // The actual socket used
     int fd = 0;
     bool isDead = false;
-    enum Type { UNKNOWN, TCP, UDP, } type = Type::UNKNOWN;
+    // SHARED_UDP proxies send/receive through the udpPool.  They only get
+    // a socket of their own (fd is otherwise 0) if the pool has no socket 
+    // free for one of their peers.
+    enum Type { UNKNOWN, TCP, UDP, SHARED_UDP, } type = Type::UNKNOWN;
+    // For SHARED_UDP, the pool socket that is tried first
+    unsigned int poolHome = 0;
 };
 
 struct Client {
@@ -54,6 +456,8 @@ struct Client {
     void close() {
         // Close all proxies
         for (Proxy p : proxies) p.close();
+        udpPool.releaseClient(fd);
+        endRaw();
         if (fd != 0) {
             cout << "Closing client" << endl;
             ::close(fd);
@@ -63,7 +467,11 @@ struct Client {
     void cleanup() {
         if (!proxies.empty()) {
             for (Proxy p : proxies) {
-                if (p.isDead) p.close();
+                if (p.isDead) {
+                    if (p.type == Proxy::Type::SHARED_UDP) 
+                        udpPool.release(fd, p.clientId);
+                    p.close();
+                }
             }
             proxies.erase(
                 std::remove_if(
@@ -90,6 +498,23 @@ struct Client {
 
     uint16_t getFrameLen() const { return recBuf[0] << 8 | recBuf[1]; }
 
+    void endRaw() {
+        if (raw) {
+            ::close(rawPipe[0]);
+            ::close(rawPipe[1]);
+            raw = false;
+        }
+    }
+
+    // When raw is set the connection is in unframed passthrough for the
+    // rawId channel (see RequestRawTCP)
+    bool raw = false;
+    uint16_t rawId = 0;
+    uint32_t rawDownLeft = 0;
+    uint32_t rawUpLeft = 0;
+    // Used to splice() data between the client and the proxy
+    int rawPipe[2] = { 0, 0 };
+
     // All of the active proxies for this client
     std::vector<Proxy> proxies;
 };
@@ -107,6 +532,28 @@ static void sendTCPOpenRespToClient(Client& client, uint16_t clientId, uint8_t c
     write(client.fd, header, totalLen);
 }
 
+// Extended form used for REQ_OPEN_TCP_NAME, includes the address/port that
+// was actually connected.
+static void sendTCPOpenRespToClient(Client& client, uint16_t clientId, uint8_t c, 
+    uint32_t addr, uint16_t port) {
+    uint8_t header[12];
+    uint16_t totalLen = 12;
+    header[0] = (totalLen & 0xff00) >> 8;
+    header[1] = (totalLen & 0x00ff);
+    header[2] = ClientFrameType::RESP_OPEN_TCP;
+    header[3] = (clientId & 0xff00) >> 8;
+    header[4] = clientId & 0x00ff;
+    header[5] = c;
+    header[6] = (addr & 0xff000000) >> 24;
+    header[7] = (addr & 0x00ff0000) >> 16;
+    header[8] = (addr & 0x0000ff00) >> 8;
+    header[9] = (addr & 0x000000ff);
+    header[10] = (port & 0xff00) >> 8;
+    header[11] = port & 0x00ff;
+    // TODO: ERROR
+    write(client.fd, header, totalLen);
+}
+
 static void sendCloseRespToClient(Client& client, uint16_t clientId, uint8_t c) {
     uint8_t header[8];
     uint16_t totalLen = 6;
@@ -192,6 +639,183 @@ static void sendUDPBindRespToClient(Client& client, uint16_t id, uint16_t rc) {
     write(client.fd, &resp, resp.len);
 }
 
+static void sendRawRespToClient(Client& client, uint16_t id, uint16_t rc) {
+    ResponseRawTCP resp;
+    resp.len = sizeof(ResponseRawTCP);
+    resp.type = ClientFrameType::RESP_RAW_TCP;
+    resp.clientId = id;
+    resp.rc = rc;
+    write(client.fd, &resp, resp.len);
+}
+
+/**
+ * Moves up to maxLen bytes from inFd to outFd through the pipe without
+ * copying to user space.  The pipe is always left empty.
+ *
+ * @returns The number of bytes moved, 0 on EOF, or -1 on error.
+ */
+static int spliceThrough(int pipeFds[2], int inFd, int outFd, uint32_t maxLen) {
+    ssize_t inLen = splice(inFd, NULL, pipeFds[1], NULL, 
+        std::min(maxLen, (uint32_t)RAW_SPLICE_CHUNK), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (inLen <= 0) {
+        return inLen;
+    }
+    ssize_t outLeft = inLen;
+    while (outLeft > 0) {
+        ssize_t outLen = splice(pipeFds[0], NULL, outFd, NULL, outLeft, SPLICE_F_MOVE);
+        if (outLen <= 0) {
+            return -1;
+        }
+        outLeft -= outLen;
+    }
+    return inLen;
+}
+
+// How long a successful DNS lookup is trusted.  gethostbyname() doesn't 
+// expose the record TTLs so a fixed value is used.
+static const time_t DNS_CACHE_TTL_SECONDS = 300;
+// Most names held in the cache
+static const unsigned int DNS_CACHE_MAX_ENTRIES = 256;
+
+struct DNSCacheEntry {
+    // Host byte order, in the order returned by the resolver
+    std::vector<uint32_t> addrs;
+    time_t expires = 0;
+};
+
+static std::map<std::string, DNSCacheEntry> dnsCache;
+
+/**
+ * Resolves a host name into its list of IPv4 addresses (host byte order),
+ * using the cache when a fresh entry is available.  A successful lookup
+ * always refreshes the cache.
+ *
+ * @returns true if at least one address was found.
+ */
+static bool resolveHost(const char* hostName, std::vector<uint32_t>& addrs, 
+    bool useCache) {
+
+    const time_t now = time(0);
+
+    auto it = dnsCache.find(hostName);
+    if (useCache && it != dnsCache.end()) {
+        if (it->second.expires > now) {
+            addrs = it->second.addrs;
+            return true;
+        }
+        dnsCache.erase(it);
+    }
+
+    struct hostent* he = gethostbyname(hostName);
+    if (he == 0 || he->h_addrtype != AF_INET) {
+        return false;
+    }
+    const in_addr** addr_list = (const in_addr **)he->h_addr_list;
+    addrs.clear();
+    for (unsigned int i = 0; addr_list[i] != 0; i++) {
+        addrs.push_back(ntohl(addr_list[i]->s_addr));
+    }
+    if (addrs.empty()) {
+        return false;
+    }
+
+    // Sweep expired entries and make room if the cache is still full
+    for (auto e = dnsCache.begin(); e != dnsCache.end(); ) {
+        if (e->second.expires <= now)
+            e = dnsCache.erase(e);
+        else 
+            e++;
+    }
+    if (dnsCache.size() >= DNS_CACHE_MAX_ENTRIES) {
+        dnsCache.erase(std::min_element(dnsCache.begin(), dnsCache.end(),
+            [](const auto& a, const auto& b) { return a.second.expires < b.second.expires; }));
+    }
+
+    DNSCacheEntry entry;
+    entry.addrs = addrs;
+    entry.expires = now + DNS_CACHE_TTL_SECONDS;
+    dnsCache[hostName] = entry;
+    return true;
+}
+
+/**
+ * Makes a new TCP connection to the target address.  The returned socket
+ * is in blocking mode.
+ *
+ * @param fastOpen If set (and TCP_FAST_OPEN is enabled) the connect may 
+ *   return before the handshake has completed, so success doesn't prove
+ *   that the target is reachable.
+ * @param timeoutSeconds If non-zero the connect is abandoned after this 
+ *   long, otherwise the connect blocks until the kernel gives up.
+ * @returns The connected socket, or -1 on failure.
+ */
+static int connectTCP(uint32_t targetAddr, uint16_t targetPort, uint16_t clientId, 
+    bool fastOpen, unsigned int timeoutSeconds, Log* log) {
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        log->error("TCP socket creation failed");
+        return -1;
+    }
+
+#if defined(TCP_FASTOPEN_CONNECT)
+    // When a Fast Open cookie is already known for the destination 
+    // connect() returns immediately and the handshake is deferred until 
+    // the first write.  Connection failures are then reported as a 
+    // close of the proxy.
+    if (TCP_FAST_OPEN && fastOpen) {
+        int yes = 1;
+        if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &yes, sizeof(yes)) != 0) 
+            log->error("setsockopt(TCP_FASTOPEN_CONNECT) failed");
+    }
+#endif
+
+    struct sockaddr_in target; 
+    memset(&target, 0, sizeof(target)); 
+    target.sin_family = AF_INET; 
+    target.sin_addr.s_addr = htonl(targetAddr); 
+    target.sin_port = htons(targetPort); 
+
+    char buf[32];
+    inet_ntop(AF_INET, &(target.sin_addr.s_addr), buf, 32);
+    log->info("TCP connecting to %s:%d (%u)", buf, targetPort, clientId);
+
+    if (timeoutSeconds == 0) {
+        if (connect(fd, (sockaddr*)&target, sizeof(target)) != 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    // Non-blocking connect so that an address that silently drops the 
+    // SYN can only stall the server for the timeout
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    if (connect(fd, (sockaddr*)&target, sizeof(target)) != 0) {
+        if (errno != EINPROGRESS) {
+            close(fd);
+            return -1;
+        }
+        fd_set wfds;
+        FD_ZERO(&wfds);
+        FD_SET(fd, &wfds);
+        struct timeval tv;
+        tv.tv_sec = timeoutSeconds;
+        tv.tv_usec = 0;
+        int err = 0;
+        socklen_t errLen = sizeof(err);
+        if (select(fd + 1, NULL, &wfds, NULL, &tv) <= 0 ||
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errLen) != 0 || err != 0) {
+            log->info("TCP connect to %s:%d failed (%u)", buf, targetPort, clientId);
+            close(fd);
+            return -1;
+        }
+    }
+    fcntl(fd, F_SETFL, flags);
+    return fd;
+}
+
 static void processClientFrame(Client& client, const uint8_t* frame, uint16_t frameLen,
     Log* log) {
 
@@ -216,22 +840,16 @@ static void processClientFrame(Client& client, const uint8_t* frame, uint16_t fr
         Proxy proxy;
         proxy.type = Proxy::Type::TCP;
         proxy.clientId = req.clientId;
-        uint32_t targetAddr = req.addr;
-        uint16_t targetPort = req.port;
 
-        proxy.fd = socket(AF_INET, SOCK_STREAM, 0);
-        struct sockaddr_in target; 
-        target.sin_family = AF_INET; 
-        target.sin_addr.s_addr = htonl(targetAddr); 
-        target.sin_port = htons(targetPort); 
-
-        char buf[32];
-        inet_ntop(AF_INET, &(target.sin_addr.s_addr), buf, 32);
-        log->info("TCP connecting to %s:%d (%u)", buf, targetPort, proxy.clientId);
+        // Use an idle connection from the pool when one is ready
+        proxy.fd = tcpPool.take(req.addr, req.port, log);
+        const bool pooled = proxy.fd >= 0;
+        if (!pooled)
+            proxy.fd = connectTCP(req.addr, req.port, proxy.clientId, true, 0, log);
+        if (proxy.fd >= 0)
+            tcpPool.recordOpen(req.addr, req.port, pooled, log);
 
-        int rc = connect(proxy.fd, (sockaddr*)&target, sizeof(target));
-        if (rc != 0) {
-            close(proxy.fd);
+        if (proxy.fd < 0) {
             // Send back an error
             sendTCPOpenRespToClient(client, proxy.clientId, 1);
         } 
@@ -241,6 +859,60 @@ static void processClientFrame(Client& client, const uint8_t* frame, uint16_t fr
             sendTCPOpenRespToClient(client, proxy.clientId, 0);
         }
     }
+    else if (reqType == ClientFrameType::REQ_OPEN_TCP_NAME) {
+
+        if (frameLen < 9) {
+            log->error("Invalid request ignored");
+            return;
+        }
+
+        RequestOpenTCPName req;
+        memcpyLimited((uint8_t*)&req, frame, frameLen, (unsigned int)sizeof(req));
+
+        // A truncated name could resolve to a different host
+        if (frameLen > sizeof(RequestOpenTCPName)) {
+            log->error("Host name too long (%u)", (uint16_t)req.clientId);
+            sendTCPOpenRespToClient(client, req.clientId, 1, 0, req.port);
+            return;
+        }
+        // Make a terminated copy of the name
+        char name[sizeof(req.name) + 1];
+        const unsigned int nameLen = std::min((unsigned int)frameLen - 8, (unsigned int)sizeof(req.name));
+        memcpy(name, req.name, nameLen);
+        name[nameLen] = 0;
+
+        Proxy proxy;
+        proxy.type = Proxy::Type::TCP;
+        proxy.clientId = req.clientId;
+        const uint16_t targetPort = req.port;
+
+        std::vector<uint32_t> addrs;
+        if (!resolveHost(name, addrs, true)) {
+            log->error("Unable to resolve %s (%u)", name, proxy.clientId);
+            sendTCPOpenRespToClient(client, proxy.clientId, 1, 0, targetPort);
+            return;
+        }
+
+        // Try each address in turn until one connects.  Fast Open isn't 
+        // used here since it would hide a failed address.
+        for (uint32_t addr : addrs) {
+            proxy.fd = tcpPool.take(addr, targetPort, log);
+            const bool pooled = proxy.fd >= 0;
+            if (!pooled)
+                proxy.fd = connectTCP(addr, targetPort, proxy.clientId, false, 
+                    TCP_NAME_CONNECT_TIMEOUT, log);
+            if (proxy.fd >= 0) {
+                // Only the address that connected counts as an open
+                tcpPool.recordOpen(addr, targetPort, pooled, log);
+                client.proxies.push_back(proxy);
+                sendTCPOpenRespToClient(client, proxy.clientId, 0, addr, targetPort);
+                return;
+            }
+        }
+
+        // Send back an error
+        sendTCPOpenRespToClient(client, proxy.clientId, 1, 0, targetPort);
+    }
     else if (reqType == ClientFrameType::REQ_SEND_TCP) {
 
         // TODO: SIZE CHECK
@@ -249,7 +921,7 @@ static void processClientFrame(Client& client, const uint8_t* frame, uint16_t fr
         //log->debugDump("Sending TCP data", req.contentPlaceholder, frameLen - 5);
 
         for (Proxy& proxy : client.proxies) {
-            if (proxy.clientId == req.clientId) {
+            if (proxy.clientId == req.clientId && proxy.type == Proxy::Type::TCP) {
                 // TODO: ERROR?                
                 write(proxy.fd, req.contentPlaceholder, frameLen - 5);
                 // Send a success message
@@ -259,6 +931,39 @@ static void processClientFrame(Client& client, const uint8_t* frame, uint16_t fr
         }
         // TODO: ERROR
     }
+    else if (reqType == ClientFrameType::REQ_RAW_TCP) {
+
+        if (frameLen < sizeof(RequestRawTCP)) {
+            log->error("Invalid request ignored");
+            return;
+        }
+
+        RequestRawTCP req;
+        memcpy(&req, frame, sizeof(req));
+
+        auto it = std::find_if(client.proxies.begin(), client.proxies.end(), 
+            [&req](const Proxy& x) { return x.clientId == req.clientId; });
+        if (it == client.proxies.end() || it->type != Proxy::Type::TCP ||
+            (req.downLen == 0 && req.upLen == 0)) {
+            log->error("Invalid raw request for %u", (uint16_t)req.clientId);
+            sendRawRespToClient(client, req.clientId, 1);
+            return;
+        }
+        if (pipe(client.rawPipe) != 0) {
+            log->error("Pipe creation failed");
+            sendRawRespToClient(client, req.clientId, 1);
+            return;
+        }
+
+        log->info("Raw passthrough for %u down %u up %u", it->clientId,
+            (uint32_t)req.downLen, (uint32_t)req.upLen);
+        client.raw = true;
+        client.rawId = it->clientId;
+        client.rawDownLeft = req.downLen;
+        client.rawUpLeft = req.upLen;
+        // Everything after this response is unframed
+        sendRawRespToClient(client, req.clientId, 0);
+    }
     else if (reqType == ClientFrameType::REQ_SEND_UDP) {
 
         if (frameLen < 12) {
@@ -282,7 +987,34 @@ static void processClientFrame(Client& client, const uint8_t* frame, uint16_t fr
         auto it = std::find_if(client.proxies.begin(), client.proxies.end(), 
             [&req](const Proxy& x) { return x.clientId == req.id; });
         if (it != client.proxies.end()) {
-            sendto(it->fd, req.data, dataLen, 0, 
+            int fd = it->fd;
+            if (it->type == Proxy::Type::SHARED_UDP) {
+                fd = udpPool.selectSocket(client.fd, it->clientId, it->poolHome, 
+                    req.addr, req.port);
+                // Every pool socket is already carrying this peer for another
+                // channel, fall back to a dedicated socket for this channel
+                if (fd < 0) {
+                    if (it->fd == 0) {
+                        it->fd = socket(AF_INET, SOCK_DGRAM, 0);
+                        struct sockaddr_in bindAddr; 
+                        memset(&bindAddr, 0, sizeof(bindAddr)); 
+                        bindAddr.sin_family = AF_INET; 
+                        bindAddr.sin_addr.s_addr = INADDR_ANY; 
+                        bindAddr.sin_port = 0; 
+                        if (it->fd < 0 || 
+                            bind(it->fd, (const struct sockaddr *)&bindAddr, sizeof(bindAddr)) < 0) {
+                            log->error("Failed to open fallback socket for id %u", it->clientId);
+                            if (it->fd > 0)
+                                close(it->fd);
+                            it->fd = 0;
+                            return;
+                        }
+                        log->info("Shared pool full, id %u using its own socket", it->clientId);
+                    }
+                    fd = it->fd;
+                }
+            }
+            sendto(fd, req.data, dataLen, 0, 
                 (const struct sockaddr *)&peerAddr, sizeof(peerAddr));
             // TODO: ERRORS?
         }
@@ -292,18 +1024,13 @@ static void processClientFrame(Client& client, const uint8_t* frame, uint16_t fr
         RequestQueryDNS req;
         memcpy(&req, frame, std::min((unsigned int)frameLen, (unsigned int)sizeof(req)));
 
-        struct hostent* he = gethostbyname(req.name);
-        if (he == 0) {
+        std::vector<uint32_t> addrs;
+        // Always a fresh lookup so that round-robin answers still rotate
+        if (!resolveHost(req.name, addrs, false)) {
             // Send a failure message
             sendDNSQueryRespToClient(client, 0, 0, 1);
         } else {
-            const in_addr** addr_list = (const in_addr **)he->h_addr_list;
-            if (addr_list[0] == 0) {
-                // Send a failure message
-                sendDNSQueryRespToClient(client, 0, 0, 1);
-            } else {
-                sendDNSQueryRespToClient(client, req.name, ntohl(addr_list[0]->s_addr), 0);                
-            }
+            sendDNSQueryRespToClient(client, req.name, addrs[0], 0);
         }
     }
     else if (reqType == ClientFrameType::REQ_BIND_UDP) {
@@ -315,6 +1042,16 @@ static void processClientFrame(Client& client, const uint8_t* frame, uint16_t fr
         proxy.type = Proxy::Type::UDP;
         proxy.clientId = req.id;
 
+        // Ephemeral binds are carried on the shared pool when enabled
+        if (req.bindPort == 0 && udpPool.isEnabled()) {
+            proxy.type = Proxy::Type::SHARED_UDP;
+            proxy.poolHome = udpPool.assignHome();
+            log->info("Bound id %d on shared pool", req.id);
+            client.proxies.push_back(proxy);
+            sendUDPBindRespToClient(client, req.id, 0);
+            return;
+        }
+
         proxy.fd = socket(AF_INET, SOCK_DGRAM, 0);
         
         struct sockaddr_in serverAddr; 
@@ -385,13 +1122,25 @@ int main(int argc, const char** argv) {
     flags = (flags | O_NONBLOCK);
     fcntl(serverFd, F_SETFL, flags);
 
+    if (SHARED_UDP_POOL_SIZE > 0) {
+        if (!udpPool.open(SHARED_UDP_POOL_SIZE, &log)) {
+            return -3;
+        }
+    }
+
     struct timeval tv;
     tv.tv_sec = 0;
     tv.tv_usec = 500;
     fd_set rfds, wfds;
+    time_t lastPoolMaintain = 0;
 
     while (true) {
 
+        if (tcpPool.isEnabled() && time(0) != lastPoolMaintain) {
+            tcpPool.maintain(&log);
+            lastPoolMaintain = time(0);
+        }
+
         FD_ZERO(&rfds);
         FD_ZERO(&wfds);
         FD_SET(serverFd, &rfds);
@@ -399,15 +1148,34 @@ int main(int argc, const char** argv) {
 
         // Add clients
         for (const Client& client : clients) {
-            maxFd = std::max(maxFd, client.fd);
-            FD_SET(client.fd, &rfds);
+            // In raw mode the client is only read while upstream bytes 
+            // are still expected and only the raw proxy is read (while 
+            // downstream bytes are expected).  Everything else waits until 
+            // framed mode resumes.
+            if (!client.raw || client.rawUpLeft > 0) {
+                maxFd = std::max(maxFd, client.fd);
+                FD_SET(client.fd, &rfds);
+            }
             // Add proxies
             for (const Proxy& proxy : client.proxies) {
+                if (proxy.type == Proxy::Type::SHARED_UDP && proxy.fd == 0) 
+                    continue;
+                if (client.raw && (proxy.clientId != client.rawId || client.rawDownLeft == 0))
+                    continue;
                 maxFd = std::max(maxFd, proxy.fd);
                 FD_SET(proxy.fd, &rfds);
             }
         }
 
+        // Add idle TCP connections
+        tcpPool.addFds(&rfds, &wfds, maxFd);
+
+        // Add shared UDP sockets
+        for (int fd : udpPool.fds()) {
+            maxFd = std::max(maxFd, fd);
+            FD_SET(fd, &rfds);
+        }
+
         int active = select(maxFd + 1, &rfds, &wfds, NULL, &tv);
         if (active > 0) {
 
@@ -455,6 +1223,48 @@ int main(int argc, const char** argv) {
             // Check all clients for activity
             for (Client& client : clients) {
                 
+                if (client.raw) {
+                    auto raw = std::find_if(client.proxies.begin(), client.proxies.end(), 
+                        [&client](const Proxy& x) { return x.clientId == client.rawId; });
+                    // Shouldn't happen, but framing can't be recovered 
+                    // without the raw proxy so drop the client
+                    if (raw == client.proxies.end()) {
+                        log.error("Raw proxy %u missing", client.rawId);
+                        client.endRaw();
+                        client.isDead = true;
+                        continue;
+                    }
+
+                    if (client.rawUpLeft > 0 && FD_ISSET(client.fd, &rfds)) {
+                        int rc = spliceThrough(client.rawPipe, client.fd, raw->fd, client.rawUpLeft);
+                        if (rc <= 0) {
+                            client.isDead = true;
+                            log.info("Client disconnected during raw passthrough");
+                        } else {
+                            client.rawUpLeft -= rc;
+                        }
+                    }
+                    if (!client.isDead && client.rawDownLeft > 0 && FD_ISSET(raw->fd, &rfds)) {
+                        int rc = spliceThrough(client.rawPipe, raw->fd, client.fd, client.rawDownLeft);
+                        if (rc <= 0) {
+                            // The client is expecting more raw bytes, there
+                            // is no way to recover framing so drop the client
+                            client.isDead = true;
+                            log.info("Proxy %u disconnected during raw passthrough", raw->clientId);
+                        } else {
+                            client.rawDownLeft -= rc;
+                        }
+                    }
+                    // Transfer complete, close the channel and resume framing
+                    if (!client.isDead && client.rawUpLeft == 0 && client.rawDownLeft == 0) {
+                        log.info("Raw passthrough complete for %u", raw->clientId);
+                        client.endRaw();
+                        raw->isDead = true;
+                        sendCloseRespToClient(client, raw->clientId, 0);
+                    }
+                    continue;
+                }
+
                 if (FD_ISSET(client.fd, &rfds)) {
                     // Decide how much to read
                     uint16_t maxReadSize;
@@ -480,8 +1290,16 @@ int main(int argc, const char** argv) {
                     }
                 }
 
+                // The frame just processed may have switched the client into 
+                // raw passthrough.  No framed output is allowed after the 
+                // RESP_RAW_TCP, the proxies are picked up on the next pass.
+                if (client.raw)
+                    continue;
+
                 // Check all proxies for activity
                 for (Proxy& proxy : client.proxies) {
+                    if (proxy.type == Proxy::Type::SHARED_UDP && proxy.fd == 0)
+                        continue;
                     if (FD_ISSET(proxy.fd, &rfds)) {
 
                         if (proxy.type == Proxy::Type::TCP) {
@@ -500,7 +1318,8 @@ int main(int argc, const char** argv) {
                                 sendTCPRecvRespToClient(client, proxy.clientId, buf, rc);
                             }
                         } 
-                        else if (proxy.type == Proxy::Type::UDP) {
+                        else if (proxy.type == Proxy::Type::UDP || 
+                                 proxy.type == Proxy::Type::SHARED_UDP) {
                             uint8_t buf[1024];
                             struct sockaddr_in peerAddr;         
                             socklen_t peerAddrLen = sizeof(peerAddr);            
@@ -523,6 +1342,39 @@ int main(int argc, const char** argv) {
                     }
                 }
             }
+
+            // Progress/check idle TCP connections
+            tcpPool.poll(&rfds, &wfds, &log);
+
+            // Check shared UDP sockets and route to the owning channels
+            for (unsigned int i = 0; i < udpPool.fds().size(); i++) {
+                const int fd = udpPool.fds()[i];
+                if (!FD_ISSET(fd, &rfds)) 
+                    continue;
+                for (unsigned int n = 0; n < SHARED_UDP_DRAIN_LIMIT; n++) {
+                    uint8_t buf[1024];
+                    struct sockaddr_in peerAddr;         
+                    socklen_t peerAddrLen = sizeof(peerAddr);            
+                    int rc = recvfrom(fd, (char*)buf, sizeof(buf), MSG_DONTWAIT,
+                        (sockaddr*)&peerAddr, &peerAddrLen);
+                    if (rc < 0) 
+                        break;
+                    const uint32_t addr = ntohl(peerAddr.sin_addr.s_addr);
+                    const uint16_t port = ntohs(peerAddr.sin_port);
+                    SharedUDPPool::Owner owner;
+                    if (!udpPool.lookup(i, addr, port, owner))
+                        continue;
+                    auto it = std::find_if(clients.begin(), clients.end(), 
+                        [&owner](const Client& x) { return x.fd == owner.clientFd; });
+                    // Framed data can't be mixed into a raw passthrough, the 
+                    // datagram is dropped
+                    if (it == clients.end() || it->isDead || it->raw)
+                        continue;
+                    log.info("Received UDP data from shared pool for id %u len %d", 
+                        owner.channelId, rc);
+                    sendRecvDataToClient(*it, owner.channelId, buf, rc, IPAddress(addr), port);
+                }
+            }
         }
 
         // Cleanup dead proxies